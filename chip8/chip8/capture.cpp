@@ -0,0 +1,447 @@
+#include "capture.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PNG_MAX_STORED_BLOCK 65535											// max length of an uncompressed deflate block
+
+static unsigned long crcTable[256];
+static bool crcTableReady = false;
+
+static void makeCrcTable()													// CRC-32 table as in PNG specification, annex D
+{
+	for (unsigned long n = 0; n < 256; ++n)
+	{
+		unsigned long c = n;
+		for (int k = 0; k < 8; ++k)
+			c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+		crcTable[n] = c;
+	}
+	crcTableReady = true;
+}
+
+static unsigned long crcUpdate(unsigned long crc, const unsigned char* data, size_t length)
+{
+	for (size_t i = 0; i < length; ++i)
+		crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static void putBigEndian32(unsigned char* out, unsigned long value)
+{
+	out[0] = (unsigned char)(value >> 24);
+	out[1] = (unsigned char)(value >> 16);
+	out[2] = (unsigned char)(value >> 8);
+	out[3] = (unsigned char)value;
+}
+
+static void writePngChunk(FILE* f, const char* type, const unsigned char* data, size_t length)
+{
+	unsigned char header[8];
+	unsigned char footer[4];
+	putBigEndian32(header, (unsigned long)length);							// chunk: length, type, data, CRC of type and data
+	memcpy(header + 4, type, 4);
+	unsigned long crc = crcUpdate(0xFFFFFFFFUL, header + 4, 4);
+	crc = crcUpdate(crc, data, length) ^ 0xFFFFFFFFUL;
+	putBigEndian32(footer, crc);
+	fwrite(header, 1, 8, f);
+	fwrite(data, 1, length, f);
+	fwrite(footer, 1, 4, f);
+}
+
+static inline int lowestSetBit(unsigned int value)						// value must not be 0
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return (int)index;
+#else
+	return __builtin_ctz(value);
+#endif
+}
+
+static inline int pixelAt(const unsigned long long* rows, int x, int y)
+{
+	return (int)(rows[y] >> x) & 1;
+}
+
+Capture::Capture()
+{
+	framesTotal = 0;
+	framesEncoded = 0;
+	framesDropped = 0;
+	stream = NULL;
+	scratch = NULL;
+	pendingRows = 0;
+	buffered = 0;
+	head = 0;
+	tail = 0;
+	running = false;
+	sleeping = false;
+	waiting = false;
+}
+
+Capture::~Capture()
+{
+	close();
+}
+
+bool Capture::open(CaptureFormat format, const char* path, int scale, bool lossless)
+{
+	if (running)
+	{
+		fprintf(stderr, "Capture already running.\n");
+		return false;
+	}
+	if (scale < 1 || scale > CAPTURE_MAX_SCALE)
+	{
+		fprintf(stderr, "Capture scale must be between 1 and %d.\n", CAPTURE_MAX_SCALE);
+		return false;
+	}
+	this->format = format;
+	this->scale = scale;
+	this->lossless = lossless;
+	strncpy_s(this->path, sizeof(this->path), path, _TRUNCATE);
+
+	size_t width = SCREEN_WIDTH * scale;
+	size_t height = SCREEN_HEIGHT * scale;
+	size_t scratchSize = width * height * 3 / 2;							// Y4M: one whole frame, Y plane + quarter size U and V
+	if (format == CAPTURE_RLE)
+		scratchSize = CAPTURE_WRITE_BUFFER;									// RLE: records collected for one write
+	else if (format == CAPTURE_PNG)
+	{
+		size_t rawSize = height * (1 + (width + 7) / 8);					// filter byte + 1-bit pixels per row
+		size_t blocks = (rawSize + PNG_MAX_STORED_BLOCK - 1) / PNG_MAX_STORED_BLOCK;
+		scratchSize = rawSize + 2 + blocks * 5 + rawSize + 4;				// raw image + zlib header, block headers, data, adler32
+		if (!crcTableReady)
+			makeCrcTable();
+	}
+	scratch = (unsigned char*)malloc(scratchSize);
+	if (scratch == NULL)
+	{
+		fprintf(stderr, "Error allocating memory.\n");
+		return false;
+	}
+
+	if (format != CAPTURE_PNG)
+	{
+		fopen_s(&stream, path, "wb");
+		if (stream == NULL)
+		{
+			fprintf(stderr, "Error opening capture file %s.\n", path);
+			free(scratch);
+			scratch = NULL;
+			return false;
+		}
+		if (format == CAPTURE_Y4M)
+			fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", (int)width, (int)height, CAPTURE_FPS);
+		else
+		{
+			unsigned char header[8] = { 'C', 'H', '8', 'R', 'L', 'E', SCREEN_WIDTH, SCREEN_HEIGHT };
+			fwrite(header, 1, sizeof(header), stream);
+		}
+	}
+
+	framesTotal = 0;
+	framesEncoded = 0;
+	framesDropped = 0;
+	for (int y = 0; y < SCREEN_HEIGHT; ++y)
+		queued[y] = 0;														// Recording starts from a blank screen
+	pendingRows = 0;
+	head = 0;
+	tail = 0;
+	sleeping = false;
+	waiting = false;
+	running = true;
+	encoder = std::thread(&Capture::encoderLoop, this);
+	return true;
+}
+
+void Capture::submitFrame(const unsigned long long* rows, unsigned int dirtyRows)
+{
+	if (!running)
+		return;
+	unsigned long number = framesTotal++;
+	unsigned int check = dirtyRows | pendingRows;
+	if (check == 0)															// Nothing drawn - encoder extends previous frame
+		return;
+
+	unsigned long position = tail.load(std::memory_order_relaxed);
+	if (position - head.load(std::memory_order_acquire) == CAPTURE_QUEUE_SIZE)
+	{
+		if (!lossless)														// Never wait for the encoder, drop the frame instead.
+		{																	// Its rows are compared again on the next frame,
+			pendingRows = check;											// so the next queued frame carries its changes
+			for (; check != 0; check &= check - 1)
+			{
+				int y = lowestSetBit(check);
+				if (rows[y] != queued[y])
+				{
+					++framesDropped;
+					break;
+				}
+			}
+			return;
+		}
+		std::unique_lock<std::mutex> guard(lock);							// Recording: sleep until the encoder frees a batch of slots
+		waiting = true;
+		ready.wait(guard, [this, position] { return position - head.load() < CAPTURE_QUEUE_SIZE; });
+		waiting = false;
+	}
+
+	Frame& slot = queue[position & (CAPTURE_QUEUE_SIZE - 1)];
+	unsigned int changed = 0;
+	int count = 0;
+	for (; check != 0; check &= check - 1)									// XOR delta of the drawn rows only
+	{
+		int y = lowestSetBit(check);
+		unsigned long long delta = rows[y] ^ queued[y];
+		if (delta != 0)
+		{
+			slot.delta[count++] = delta;
+			changed |= 1u << y;
+			queued[y] = rows[y];
+		}
+	}
+	pendingRows = 0;
+	if (changed == 0)														// Drawn but unchanged (sprite erased and redrawn) - slot stays free
+		return;
+	slot.rows = changed;
+	slot.number = number;
+	tail.store(position + 1, std::memory_order_release);					// Publish frame
+	++framesEncoded;
+
+	if (position + 1 - head.load(std::memory_order_relaxed) >= CAPTURE_WAKE_BATCH)
+	{																		// Wake encoder once per batch, not per frame.
+		std::atomic_thread_fence(std::memory_order_seq_cst);				// Orders tail before sleeping, pairs with encoderLoop
+		if (sleeping.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			ready.notify_one();
+		}
+	}
+}
+
+void Capture::close()
+{
+	if (!running)
+		return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		running = false;
+		ready.notify_one();
+	}
+	encoder.join();															// Encoder drains the queue before it exits
+
+	if (stream != NULL)
+	{
+		fclose(stream);
+		stream = NULL;
+	}
+	free(scratch);
+	scratch = NULL;
+}
+
+void Capture::encoderLoop()
+{
+	Frame blank;															// A frame is written once the next one arrives,
+	blank.number = 0;														// so its on-screen duration is known.
+	blank.rows = 0;															// Recording starts with the blank screen of frame 0
+	const Frame* previous = &blank;
+	for (int y = 0; y < SCREEN_HEIGHT; ++y)
+		screen[y] = 0;
+	buffered = 0;
+	unsigned long position = 0;
+
+	for (;;)
+	{
+		bool stopping = !running.load();									// Read before tail, so no frame published before close() is missed
+		unsigned long end = tail.load();
+		if (position == end)
+		{
+			if (stopping)
+				break;
+			std::unique_lock<std::mutex> guard(lock);
+			sleeping = true;												// Producer checks sleeping after publishing, we check tail after
+			ready.wait(guard, [this, position] { return tail.load() - position >= CAPTURE_WAKE_BATCH || !running.load(); });
+			sleeping = false;
+			continue;
+		}
+
+		for (; position != end; ++position)									// Encode everything queued, then free the slots at once
+		{
+			const Frame& current = queue[position & (CAPTURE_QUEUE_SIZE - 1)];
+			writeFrame(*previous, current.number - previous->number);		// screen still shows previous here
+			if (format != CAPTURE_RLE)										// RLE only needs the delta
+			{
+				int count = 0;
+				for (unsigned int rows = current.rows; rows != 0; rows &= rows - 1, ++count)
+					screen[lowestSetBit(rows)] ^= current.delta[count];
+			}
+			previous = &current;
+		}
+		head.store(position - 1, std::memory_order_release);				// Slots may now be reused by producer, except
+																			// the one of previous, which is not written yet
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);				// Orders head before waiting, pairs with submitFrame
+		if (waiting.load(std::memory_order_relaxed))
+		{																	// Wake lossless producer waiting for free slots
+			std::lock_guard<std::mutex> guard(lock);
+			ready.notify_one();
+		}
+	}
+	writeFrame(*previous, framesTotal - previous->number);
+	if (format == CAPTURE_RLE)
+		flushRle();
+}
+
+void Capture::writeFrame(const Frame& frame, unsigned long duration)
+{
+	if (duration == 0)														// Only the blank start frame, when frame 0 was drawn to
+		return;
+	switch (format)
+	{
+		case CAPTURE_PNG: writePng(frame.number); break;
+		case CAPTURE_Y4M: writeY4m(duration); break;
+		case CAPTURE_RLE: writeRle(frame, duration); break;
+	}
+}
+
+void Capture::writePng(unsigned long number)
+{
+	int width = SCREEN_WIDTH * scale;
+	int height = SCREEN_HEIGHT * scale;
+	size_t rowBytes = (width + 7) / 8;
+	size_t rawSize = height * (1 + rowBytes);
+	unsigned char* raw = scratch;
+	unsigned char* zlib = scratch + rawSize;
+
+	unsigned char* out = raw;												// Build filtered image data, 1 bit per pixel, MSB first
+	for (int y = 0; y < height; ++y)
+	{
+		*out++ = 0;															// filter type: none
+		memset(out, 0, rowBytes);
+		for (int x = 0; x < width; ++x)
+			if (pixelAt(screen, x / scale, y / scale))
+				out[x >> 3] |= 0x80 >> (x & 7);
+		out += rowBytes;
+	}
+
+	unsigned long adlerA = 1, adlerB = 0;									// Wrap in zlib stream made of stored (uncompressed) deflate blocks
+	for (size_t i = 0; i < rawSize; ++i)
+	{
+		adlerA = (adlerA + raw[i]) % 65521;
+		adlerB = (adlerB + adlerA) % 65521;
+	}
+	out = zlib;
+	*out++ = 0x78;
+	*out++ = 0x01;
+	for (size_t offset = 0; offset < rawSize; offset += PNG_MAX_STORED_BLOCK)
+	{
+		size_t length = rawSize - offset;
+		if (length > PNG_MAX_STORED_BLOCK)
+			length = PNG_MAX_STORED_BLOCK;
+		*out++ = (offset + length == rawSize) ? 1 : 0;						// BFINAL on last block, BTYPE = 00
+		*out++ = (unsigned char)length;
+		*out++ = (unsigned char)(length >> 8);
+		*out++ = (unsigned char)~length;
+		*out++ = (unsigned char)(~length >> 8);
+		memcpy(out, raw + offset, length);
+		out += length;
+	}
+	putBigEndian32(out, (adlerB << 16) | adlerA);
+	out += 4;
+
+	char filename[300];
+	snprintf(filename, sizeof(filename), "%s_%06lu.png", path, number);
+	FILE* f;
+	fopen_s(&f, filename, "wb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "Error opening capture file %s.\n", filename);
+		return;
+	}
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	unsigned char ihdr[13];
+	putBigEndian32(ihdr, width);
+	putBigEndian32(ihdr + 4, height);
+	ihdr[8] = 1;															// bit depth
+	ihdr[9] = 0;															// color type: grayscale
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;										// compression, filter, interlace
+	fwrite(signature, 1, sizeof(signature), f);
+	writePngChunk(f, "IHDR", ihdr, sizeof(ihdr));
+	writePngChunk(f, "IDAT", zlib, out - zlib);
+	writePngChunk(f, "IEND", NULL, 0);
+	fclose(f);
+}
+
+void Capture::writeY4m(unsigned long duration)
+{
+	int width = SCREEN_WIDTH * scale;
+	int height = SCREEN_HEIGHT * scale;
+	size_t frameSize = (size_t)width * height * 3 / 2;
+
+	unsigned char* out = scratch;											// Y plane: 0 black, 255 white (full range)
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+			*out++ = pixelAt(screen, x / scale, y / scale) ? 255 : 0;
+	memset(out, 128, frameSize - (out - scratch));							// U and V planes: no color
+
+	for (unsigned long repeat = 0; repeat < duration; ++repeat)				// Y4M has no frame timing, repeat the frame instead
+	{
+		fputs("FRAME\n", stream);
+		fwrite(scratch, 1, frameSize, stream);
+	}
+}
+
+void Capture::writeRle(const Frame& frame, unsigned long duration)
+{
+	if (buffered + 4 + 2 * CAPTURE_FRAME_BYTES > CAPTURE_WRITE_BUFFER)		// Room for a record with every byte changed
+		flushRle();
+	unsigned char* record = scratch + buffered;
+	unsigned char* out = record + 4;
+	int next = 0;															// byte after the previous pair
+	int count = 0;
+	for (unsigned int rows = frame.rows; rows != 0; rows &= rows - 1, ++count)
+	{
+		int y = lowestSetBit(rows);
+		for (int half = 0; half < 2; ++half)								// Changed bytes found 32 bits at a time
+		{
+			unsigned int bits = (unsigned int)(frame.delta[count] >> (half * 32));
+			while (bits != 0)
+			{
+				int shift = lowestSetBit(bits) & ~7;
+				int index = y * (SCREEN_WIDTH / 8) + half * 4 + shift / 8;
+				*out++ = (unsigned char)(index - next);
+				*out++ = (unsigned char)(bits >> shift);
+				bits &= ~(0xFFu << shift);
+				next = index + 1;
+			}
+		}
+	}
+	int pairs = (int)(out - record - 4) / 2;
+
+	unsigned long hold = duration > 0xFFFF ? 0xFFFF : duration;
+	record[0] = (unsigned char)hold;
+	record[1] = (unsigned char)(hold >> 8);
+	record[2] = (unsigned char)pairs;
+	record[3] = (unsigned char)(pairs >> 8);
+	buffered = out - scratch;
+
+	for (duration -= hold; duration > 0; duration -= hold)					// Holds longer than 16 bits continue in records
+	{																		// without changes
+		if (buffered + 4 > CAPTURE_WRITE_BUFFER)
+			flushRle();
+		hold = duration > 0xFFFF ? 0xFFFF : duration;
+		out = scratch + buffered;
+		out[0] = (unsigned char)hold;
+		out[1] = (unsigned char)(hold >> 8);
+		out[2] = out[3] = 0;
+		buffered += 4;
+	}
+}
+
+void Capture::flushRle()
+{
+	fwrite(scratch, 1, buffered, stream);
+	buffered = 0;
+}
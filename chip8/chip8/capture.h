@@ -0,0 +1,81 @@
+#pragma once
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "chip8.h"
+
+#define CAPTURE_QUEUE_SIZE 4096			// frames the encoder may lag behind, must be a power of two
+#define CAPTURE_WAKE_BATCH 1024			// sleeping encoder is woken once this many frames wait
+#define CAPTURE_FRAME_BYTES (SCREEN_SIZE / 8)	// RLE frames are packed 1 bit per pixel
+#define CAPTURE_WRITE_BUFFER 65536			// RLE records are collected and written in blocks of this size
+#define CAPTURE_FPS 60						// emulationFrame() is called 60 times per second
+#define CAPTURE_MAX_SCALE 50
+
+/*	Capture formats
+	PNG - one 1-bit grayscale file per changed frame, named <path>_<frame number>.png
+	Y4M - uncompressed YUV4MPEG2 stream (C420), unchanged frames are repeated to keep timing
+	RLE - "CH8RLE", width and height bytes, followed by one record per changed frame, starting from a blank screen.
+		  The frame is packed into 256 bytes, pixel x, y in bit x % 8 of byte y * 8 + x / 8. Each record stores
+		  its XOR delta against the previous record, runs of unchanged bytes are skipped:
+		  2 bytes (little endian) - number of frames the record is held on screen
+		  2 bytes (little endian) - number of changed bytes
+		  one pair per changed byte - number of unchanged bytes skipped since the previous pair, byte to XOR in */
+enum CaptureFormat { CAPTURE_PNG, CAPTURE_Y4M, CAPTURE_RLE };
+
+class Capture {
+	public:
+		Capture();
+		~Capture();
+		bool open(CaptureFormat format, const char* path, int scale, bool lossless);
+		void submitFrame(const unsigned long long* rows, unsigned int dirtyRows);
+		void close();
+		bool isOpen() const { return running; }
+
+		unsigned long framesTotal;						// frames submitted (including duplicates)
+		unsigned long framesEncoded;					// unique frames handed to encoder
+		unsigned long framesDropped;					// changed frames not queued because the queue was full, the next
+														// queued frame still carries their pixels
+
+	private:
+		struct Frame {									// XOR delta against the previously queued frame
+			unsigned long number;						// index of the emulated frame it was captured on
+			unsigned int rows;							// bit y set when row y changed
+			unsigned long long delta[SCREEN_HEIGHT];	// one entry per set bit of rows, in order of y
+		};
+
+		void encoderLoop();
+		void writeFrame(const Frame& frame, unsigned long duration);
+		void writePng(unsigned long number);
+		void writeY4m(unsigned long duration);
+		void writeRle(const Frame& frame, unsigned long duration);
+		void flushRle();
+
+		CaptureFormat format;
+		char path[260];
+		int scale;										// each CHIP-8 pixel becomes scale x scale pixels (PNG, Y4M)
+		bool lossless;									// wait for the encoder instead of dropping frames
+		FILE* stream;									// output stream for Y4M and RLE
+
+		unsigned long long queued[SCREEN_HEIGHT];		// producer: screen as of the last queued frame
+		unsigned int pendingRows;						// producer: rows drawn on dropped frames, compared again next frame
+		unsigned long long screen[SCREEN_HEIGHT];		// encoder: screen as of the frame being written
+		size_t buffered;								// encoder: bytes of RLE records waiting in scratch
+
+		/*	Single producer (emulation thread), single consumer (encoder thread) ring buffer.
+			Only the producer writes tail, only the encoder writes head, so no lock is needed to pass frames.
+			The mutex and condition variable are used only to put an idle encoder, or a lossless producer
+			facing a full queue, to sleep. */
+		Frame queue[CAPTURE_QUEUE_SIZE];
+		std::atomic<unsigned long> head;				// oldest slot the encoder still uses
+		std::atomic<unsigned long> tail;				// next free slot
+		std::atomic<bool> running;
+		std::atomic<bool> sleeping;						// encoder found queue empty and waits for a batch of frames
+		std::atomic<bool> waiting;						// lossless producer found queue full and waits for free slots
+		std::mutex lock;
+		std::condition_variable ready;
+		std::thread encoder;
+
+		unsigned char* scratch;							// encoder-only buffer for scaled pixel rows or RLE records
+};
@@ -0,0 +1,38 @@
+@echo off
+rem Runs every bundled ROM headless with a fixed seed and compares a hash of the final screen and fault flags.
+rem Usage: check_roms.bat [path to chip8.exe]   (default ..\x64\Debug\chip8.exe)
+rem After a change that is meant to alter emulation, update the hashes from the "State hash" line of each run.
+setlocal
+cd /d "%~dp0"
+set CHIP8=%~1
+if "%CHIP8%"=="" set CHIP8=..\x64\Debug\chip8.exe
+set FAILED=0
+
+call :check tetris.c8 9BF3FDF9
+call :check BC_test.ch8 13AAE64D
+call :check invaders.c8 591C3E13
+call :check pong2.c8 CD5458D2
+
+rem Small ROMs that leave the emulated hardware, the hash includes the fault flags they must set
+call :check fault_fx55.ch8 93ADD20A
+call :check fault_stack17.ch8 DE76DB1F
+call :check fault_return.ch8 DC76D7F9
+call :check fault_key.ch8 E876EADD
+call :check fault_bnnn.ch8 DF76DCB2
+
+if %FAILED% neq 0 (
+	echo %FAILED% ROM check^(s^) failed
+	exit /b 1
+)
+echo All ROM checks passed
+exit /b 0
+
+:check
+"%CHIP8%" %1 -headless 3000 -seed 1 -expect %2 >nul
+if errorlevel 1 (
+	echo FAILED %1
+	set /a FAILED+=1
+) else (
+	echo ok     %1
+)
+exit /b 0
@@ -1,11 +1,12 @@
 #include "chip8.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <windows.h>
 
 #define VX V[(opcode & 0x0F00) >> 8]
 #define VY V[(opcode & 0x00F0) >> 4]
+#define MEM(address) memory[(address) & MEMORY_MASK]
+#define FAULT_IF(condition, flag) do { if (condition) faults |= (flag); } while (0)	// predicted branch, cheaper than rewriting faults every cycle
 
 void gotoxy(int x, int y)
 {
@@ -40,19 +41,25 @@ const unsigned char chip8_fontset[80] =
   0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-void Chip8::initialize()
+void Chip8::initialize(unsigned int seed)
 {
 	pc = 0x200;																// Program counter starts at 0x200
 	opcode = 0;																// Reset current opcode	
 	I = 0;																	// Reset index register
 	sp = 0;																	// Reset stack pointer
+	faults = 0;																// Reset fault flags
 
 	for (int i = 0; i < SCREEN_SIZE; ++i)									// Clear display
 		gfx[i] = 0;
+	for (int i = 0; i < SCREEN_HEIGHT; ++i)
+		screenRows[i] = 0;
+	dirtyRows = 0xFFFFFFFF;
 	for (int i = 0; i < STACK_SIZE; ++i)									// Clear stack
 		stack[i] = 0;
 	for (int i = 0; i < NR_OF_REGISTERS; ++i)								// Clear registers V0-VF
 		V[i] = 0;
+	for (int i = 0; i < NR_OF_KEYS; ++i)									// Clear keypad
+		key[i] = 0;
 	for (int i = 0; i < MEMORY_SIZE; ++i)									// Clear memory
 		memory[i] = 0;
 	for (int i = 0; i < 80; ++i)											// Load fontset
@@ -61,12 +68,35 @@ void Chip8::initialize()
 	delay_timer = 0;														// Reset timers
 	sound_timer = 0;
 
-	srand((unsigned int) time(NULL));										// Reset time (used for rand for opcode emulation)
+	randomState = seed;														// Reset random generator (used for CXNN)
+}
+
+unsigned int Chip8::nextRandom()											// Same LCG as MSVC rand(), kept per instance so a seed
+{																			// reproduces a run with any compiler
+	randomState = randomState * 214013 + 2531011;
+	return (randomState >> 16) & 0x7FFF;
+}
+
+static inline unsigned long long spriteRow(unsigned char pixels, unsigned char x)	// Sprite byte (leftmost pixel in bit 7) as
+{																					// screenRows bits starting at column x, wrapping around
+	unsigned long long bits = pixels;
+	bits = (bits & 0xF0) >> 4 | (bits & 0x0F) << 4;						// Reverse bit order, leftmost pixel goes to bit 0
+	bits = (bits & 0xCC) >> 2 | (bits & 0x33) << 2;
+	bits = (bits & 0xAA) >> 1 | (bits & 0x55) << 1;
+	x &= SCREEN_WIDTH - 1;
+	return bits << x | bits >> ((SCREEN_WIDTH - x) & (SCREEN_WIDTH - 1));	// Rotate, compiles to a single rol
+}
+
+inline void Chip8::jump(unsigned int address)								// Jumps, returns and skips past 0xFFF are faults and wrap around,
+{																			// straight-line code running off the end is wrapped by the fetch
+	FAULT_IF(address > MEMORY_MASK, FAULT_MEMORY);
+	pc = address & MEMORY_MASK;
 }
 
 void Chip8::emulateCycle()
 {
-	opcode = memory[pc] << 8 | memory[pc + 1];								// Fetch opcode from memory
+	pc &= MEMORY_MASK;														// Straight-line code past 0xFFF continues at 0x000
+	opcode = memory[pc] << 8 | memory[(pc + 1) & MEMORY_MASK];				// Fetch opcode from memory
 	
 	switch (opcode & 0xF000)												// Decode opcode
 	{
@@ -76,14 +106,17 @@ void Chip8::emulateCycle()
 				case 0x00E0:												// 00E0: Clears the screen
 					for (int i = 0; i < SCREEN_SIZE; ++i)
 						gfx[i] = 0;
+					for (int i = 0; i < SCREEN_HEIGHT; ++i)
+						screenRows[i] = 0;
+					dirtyRows = 0xFFFFFFFF;
 					drawFlag = true;
 					pc += 2;
 				break;
 
 				case 0x00EE:												// 00EE: Returns from a subroutine
-					--sp;													// Decrease stack pointer (sp shows next stack element to be added)
-					pc = stack[sp];											// Set stored address back to pc
-					pc += 2;												// Increase pc to do next operation on the next cycle
+					FAULT_IF(sp == 0, FAULT_STACK_UNDERFLOW);
+					sp -= (sp != 0);										// Decrease stack pointer (sp shows next stack element to be added)
+					jump(stack[sp & STACK_MASK] + 2);						// Set stored address back to pc and increase it to do next operation
 					break;
 
 				default:
@@ -98,15 +131,16 @@ void Chip8::emulateCycle()
 		break;
 
 		case 0x2000:														// 2NNN: Calls subroutine at NNN. 
-			stack[sp] = pc;													// Store current address on stack
-			++sp;															// Increment stack counter
+			FAULT_IF(sp >= STACK_SIZE, FAULT_STACK_OVERFLOW);				// 16 means stack is full, deeper calls overwrite the oldest entries
+			stack[sp & STACK_MASK] = pc;									// Store current address on stack
+			++sp;															// Increment stack counter, keeps counting past 16
 			pc = opcode & 0x0FFF;											// Set pc to NNN
 		break;
 
 		case 0x3000:														// 3XNN: Skips the next instruction if VX equals NN.
 																			// (Usually the next instruction is a jump to skip a code block)
 			if (VX == (opcode & 0x00FF))									// if (V[X] == NN)
-				pc += 4;
+				jump(pc + 4);
 			else
 				pc += 2;
 		break;
@@ -114,7 +148,7 @@ void Chip8::emulateCycle()
 		case 0x4000:														// 4XNN: Skips the next instruction if VX doesn't equal NN.
 																			// (Usually the next instruction is a jump to skip a code block)
 			if (VX != (opcode & 0x00FF))									// if (V[X] != NN)
-				pc += 4;
+				jump(pc + 4);
 			else
 				pc += 2;
 		break;
@@ -128,7 +162,7 @@ void Chip8::emulateCycle()
 				break;
 			}
 			if (VX == VY)		// if (V[X] == V[Y])
-				pc += 4;
+				jump(pc + 4);
 			else
 				pc += 2;
 		break;
@@ -239,7 +273,7 @@ void Chip8::emulateCycle()
 				break;
 			}
 			if (VX != VY)		// if (V[X] != V[Y])
-				pc += 4;
+				jump(pc + 4);
 			else
 				pc += 2;
 		break;
@@ -250,12 +284,12 @@ void Chip8::emulateCycle()
 		break;
 
 		case 0xB000:														// BNNN: Jumps to the address NNN plus V0.
-			pc = (opcode & 0x0FFF) + V[0];
+			jump((opcode & 0x0FFF) + V[0]);
 		break;
 
 		case 0xC000:														// CXNN: Sets VX to the result of a bitwise and operation
 																			// on a random number (Typically: 0 to 255) and NN.
-			VX = (rand() % 0xFF) & (opcode & 0x00FF);
+			VX = (nextRandom() % 0xFF) & (opcode & 0x00FF);
 			pc += 2;
 		break;
 
@@ -271,22 +305,23 @@ void Chip8::emulateCycle()
 			unsigned char pixels;
 
 			V[0xF] = 0;
+			FAULT_IF(I + height > MEMORY_SIZE, FAULT_MEMORY);
 
 			for (int yLine = 0; yLine < height; ++yLine)
 			{
-				pixels = memory[I + yLine];									// 8 pixels from memory which are currently to be drawn
+				pixels = MEM(I + yLine);									// 8 pixels from memory which are currently to be drawn
+				int y = (yStart + yLine) & (SCREEN_HEIGHT - 1);				// sprites wrap around screen edges
+				unsigned char* line = gfx + y * SCREEN_WIDTH;
+				screenRows[y] ^= spriteRow(pixels, xStart);
+				dirtyRows |= 1u << y;
 				for (int xLine = 0; xLine < 8; ++xLine)
 				{
 					if ((pixels & (0x80 >> xLine)) != 0)					// if pixels' (7 - xLine)th bit is 1 <=> to be drawn bit is 1
 					{
-						if (gfx[(yStart + yLine) * SCREEN_WIDTH	+ 			// if checked bit on screen is 1
-							 (xStart + xLine)] == 1)
-						{
-							V[0xF] = 1;										// both bits 1, collision on screen
-						}
-						gfx[(yStart + yLine) * SCREEN_WIDTH					// if pixels' (7 - xLine)th bit is 1, we xor
-							+ (xStart + xLine)] ^= 1;						// corresponding screen bit with 1							
-					}
+						unsigned char* pixel = line + ((xStart + xLine) & (SCREEN_WIDTH - 1));
+						V[0xF] |= *pixel;									// both bits 1, collision on screen (gfx holds only 0 or 1)
+						*pixel ^= 1;										// if pixels' (7 - xLine)th bit is 1, we xor
+					}														// corresponding screen bit with 1
 				}
 			}
 			drawFlag = true;
@@ -299,16 +334,18 @@ void Chip8::emulateCycle()
 			{
 				case 0x009E:												// EX9E: Skips the next instruction	if the key
 																			// stored in VX is pressed
-					if (key[VX] != 0)										// if key[V[X]] != 0
-						pc += 4;
+					FAULT_IF(VX > KEY_MASK, FAULT_KEY);
+					if (key[VX & KEY_MASK] != 0)							// if key[V[X]] != 0
+						jump(pc + 4);
 					else
 						pc += 2;
 				break;
 
 				case 0xA1:													// EXA1: Skips the next instruction if the key
 																			// stored in VX isn't pressed.
-					if (key[VX] == 0)										// if key[V[X]] == 0
-						pc += 4;
+					FAULT_IF(VX > KEY_MASK, FAULT_KEY);
+					if (key[VX & KEY_MASK] == 0)							// if key[V[X]] == 0
+						jump(pc + 4);
 					else
 						pc += 2;
 				break;
@@ -364,21 +401,24 @@ void Chip8::emulateCycle()
 				case 0x0033:												// FX33: Takes the decimal representation of VX, places the hundreds digit
 																			// in memory at location in I, the tens digit at location I + 1,
 																			// and the ones digit at location I + 2
-					memory[I] = (VX) / 100;
-					memory[I+1] = (VX % 100) / 10;
-					memory[I+2] = (VX % 10);
+					FAULT_IF(I + 2 > MEMORY_MASK, FAULT_MEMORY);
+					MEM(I) = (VX) / 100;
+					MEM(I+1) = (VX % 100) / 10;
+					MEM(I+2) = (VX % 10);
 					pc += 2;
 				break;
 
 				case 0x0055:												// FX55: Stores V0 to VX (including VX) in memory starting at address I
+					FAULT_IF(I + ((opcode & 0x0F00) >> 8) > MEMORY_MASK, FAULT_MEMORY);
 					for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)     
-						memory[I + i] = V[i];
+						MEM(I + i) = V[i];
 					pc += 2;
 				break;
 
 				case 0x0065:												// FX65: Fills V0 to VX (including VX) from memory starting at address I								
+					FAULT_IF(I + ((opcode & 0x0F00) >> 8) > MEMORY_MASK, FAULT_MEMORY);
 					for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-						V[i] = memory[I + i];
+						V[i] = MEM(I + i);
 					pc += 2;
 				break;
 			}
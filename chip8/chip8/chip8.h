@@ -1,3 +1,4 @@
+#pragma once
 #define SCREEN_SIZE 64 * 32
 #define SCREEN_WIDTH 64
 #define SCREEN_HEIGHT 32
@@ -5,6 +6,14 @@
 #define STACK_SIZE 16
 #define NR_OF_REGISTERS 16
 #define NR_OF_KEYS 16
+#define MEMORY_MASK (MEMORY_SIZE - 1)		// sizes are powers of two, so out of range indexes wrap around
+#define STACK_MASK (STACK_SIZE - 1)
+#define KEY_MASK (NR_OF_KEYS - 1)
+/*	Fault flags - set when a ROM indexes outside of emulated hardware, cleared only by initialize() */
+#define FAULT_MEMORY 0x01					// memory access or jump beyond 0xFFF
+#define FAULT_STACK_OVERFLOW 0x02			// more than 16 nested subroutine calls
+#define FAULT_STACK_UNDERFLOW 0x04			// return without matching call
+#define FAULT_KEY 0x08						// EX9E/EXA1 with VX above 0xF
 /*	Memory map
 	0x000 - 0x1FF - Chip 8 interpreter(contains font set in emu)
 	0x050 - 0x0A0 - Used for the built in 4x5 pixel font set(0 - F)
@@ -14,18 +23,24 @@
 class Chip8 {
 	public:
 		Chip8();
-		void initialize();
+		void initialize(unsigned int seed);
 		bool loadGame(const char* filename);
 		void emulateCycle();
 		void timersTick();
 		void debugRender();
 		
 		bool drawFlag;
+		unsigned char faults;				//sticky FAULT_* flags, access is wrapped around instead of leaving the arrays
 
 		unsigned char gfx[SCREEN_SIZE];		//black and white bitmap of the screen - each byte stores 1 if white, 0 if black
+		unsigned long long screenRows[SCREEN_HEIGHT];	//same screen 1 bit per pixel, pixel x of row y is bit x of screenRows[y]
+		unsigned int dirtyRows;				//bit y set when row y was drawn to, cleared by the caller like drawFlag
 		unsigned char key[16];				//HEX based keypad, stores 0 if key isn't pressed, else stores non-zero
 
 	private:
+		void jump(unsigned int address);
+		unsigned int nextRandom();
+
 		unsigned char memory[MEMORY_SIZE];	//4KB of memory
 		unsigned char V[NR_OF_REGISTERS];	//15 general purpose registers, VE - flags
 		unsigned short stack[STACK_SIZE];	//stack, stores return addresses after jump instructions only
@@ -33,11 +48,13 @@ class Chip8 {
 		unsigned short opcode;				//16-bit opcode - code of current operation
 		unsigned short I;					//index register, used in some memory operations
 		unsigned short pc;					//program counter PC = instruction pointer IP
-		unsigned short sp;					//stack pointer
+		unsigned short sp;					//stack pointer, counts call depth so returns after an overflow are not underflows
 
 		//both timers count down at 60 Hz until they reach 0
 		unsigned char delay_timer;			//timer used for timing events of games
 		unsigned char sound_timer;			//timer used for sound effects
 
+		unsigned int randomState;			//CXNN generator, same seed gives the same run on every platform
+
 };
 
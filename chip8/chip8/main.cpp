@@ -1,6 +1,11 @@
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
 #include <string>
+#include <chrono>
 #include "chip8.h"
+#include "capture.h"
 #include "SDL.h"
 
 struct Display
@@ -26,6 +31,8 @@ struct Display
 
 Chip8 myChip8;
 Display* myDisplay;
+Capture myCapture;
+bool headless = false;													// no window, no input, no frame cap - used with capture
 
 void setupGraphics()
 {
@@ -135,40 +142,158 @@ void drawGraphics()
 	SDL_RenderPresent(myDisplay->renderer);
 }
 
+unsigned long stateHash()												// FNV-1a over the screen and fault flags, compared by -expect
+{
+	unsigned long hash = 2166136261UL;
+	for (int i = 0; i < SCREEN_SIZE; ++i)
+		hash = ((hash ^ myChip8.gfx[i]) * 16777619UL) & 0xFFFFFFFFUL;
+	return ((hash ^ myChip8.faults) * 16777619UL) & 0xFFFFFFFFUL;
+}
+
 void emulationFrame() {
 	// Emulate 9 cycles - approximate amount of instructions for one frame
 	for(int cycles = 0; cycles < 9; cycles++)
 		myChip8.emulateCycle();
 	// If the draw flag is set, update the screen
-	if (myChip8.drawFlag)
+	if (myChip8.drawFlag && !headless)
 	{
 		//myChip8.debugRender();
 		drawGraphics();
 	}
+	// Hand the frame to the capture encoder, only rows drawn to are compared
+	myCapture.submitFrame(myChip8.screenRows, myChip8.dirtyRows);
+	myChip8.dirtyRows = 0;
 
 	// Store key press state (Press and Release)
-	handleInput();
+	if (!headless)
+		handleInput();
 	myChip8.drawFlag = false;
 	myChip8.timersTick();
 }
 
+// Usage: chip8 <rom> [resolution] [-capture png|y4m|rle <path>] [-lossless] [-headless <frames>] [-seed <n>] [-expect <hash>]
+// Capture never stalls emulation and drops frames the encoder can't keep up with, -lossless waits for it instead.
+// Exit code 3 if frames were dropped.
+// Headless runs are seeded with 1 unless -seed is given and print a hash of the final screen and fault flags,
+// -expect compares it (hex) and exits with 0 on match, 4 otherwise - see check_roms.bat.
 int main(int argc, char** argv) {
-	// Initialize the Chip8 system and load the game into the memory  
-	myChip8.initialize();
 	if (argc < 2)
 	{
 		fprintf(stderr, "No file specified.\n");
 		return 1;
 	}
-	myChip8.loadGame(argv[1]);
 
 	int resolutionModifier = 10;
-	if (argc > 2)
-		resolutionModifier = std::stoi(argv[2]);
-	if (resolutionModifier < 1 && resolutionModifier > 50)
+	int arg = 2;
+	if (argc > arg && argv[arg][0] != '-')
+		resolutionModifier = std::stoi(argv[arg++]);
+	if (resolutionModifier < 1 || resolutionModifier > CAPTURE_MAX_SCALE)
 		resolutionModifier = 10;
 	myDisplay = new Display(resolutionModifier);
 
+	const char* captureFormat = NULL;
+	const char* capturePath = NULL;
+	bool lossless = false;
+	long headlessFrames = 0;
+	bool seedGiven = false;
+	unsigned int seed = 0;
+	bool expectGiven = false;
+	unsigned long expectedHash = 0;
+	for (; arg < argc; ++arg)
+	{
+		if (strcmp(argv[arg], "-capture") == 0 && arg + 2 < argc)
+		{
+			captureFormat = argv[++arg];
+			capturePath = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "-lossless") == 0)
+			lossless = true;
+		else if (strcmp(argv[arg], "-headless") == 0 && arg + 1 < argc)
+		{
+			headless = true;
+			headlessFrames = std::stol(argv[++arg]);
+		}
+		else if (strcmp(argv[arg], "-seed") == 0 && arg + 1 < argc)
+		{
+			seedGiven = true;
+			seed = (unsigned int) std::stoul(argv[++arg]);
+		}
+		else if (strcmp(argv[arg], "-expect") == 0 && arg + 1 < argc)
+		{
+			expectGiven = true;
+			expectedHash = strtoul(argv[++arg], NULL, 16);
+		}
+		else
+		{
+			fprintf(stderr, "Unknown argument %s.\n", argv[arg]);
+			return 1;
+		}
+	}
+	if (expectGiven && !headless)
+	{
+		fprintf(stderr, "-expect needs -headless.\n");
+		return 1;
+	}
+
+	// Initialize the Chip8 system and load the game into the memory
+	if (!seedGiven)
+		seed = headless ? 1 : (unsigned int) time(NULL);				// headless runs are reproducible by default
+	myChip8.initialize(seed);
+	myChip8.loadGame(argv[1]);
+
+	if (captureFormat != NULL)
+	{
+		CaptureFormat format;
+		if (strcmp(captureFormat, "png") == 0)
+			format = CAPTURE_PNG;
+		else if (strcmp(captureFormat, "y4m") == 0)
+			format = CAPTURE_Y4M;
+		else if (strcmp(captureFormat, "rle") == 0)
+			format = CAPTURE_RLE;
+		else
+		{
+			fprintf(stderr, "Unknown capture format %s.\n", captureFormat);
+			return 1;
+		}
+		if (format == CAPTURE_Y4M && headless)							// Y4M repeats the full frame for every emulated frame
+		{
+			double bytes = (double)headlessFrames * (6 + SCREEN_SIZE * 3 / 2 * resolutionModifier * resolutionModifier);
+			if (bytes > 1e9)
+				fprintf(stderr, "Warning: Y4M capture of %ld frames will take about %.1f GB.\n", headlessFrames, bytes / 1e9);
+		}
+		if (!myCapture.open(format, capturePath, resolutionModifier, lossless))
+			return 1;
+	}
+
+	if (headless)
+	{
+		// Run uncapped for the requested number of frames
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (long frame = 0; frame < headlessFrames; ++frame)
+			emulationFrame();
+		myCapture.close();													// Waiting for the encoder to finish is part of the cost
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		printf("Emulated %ld frames in %.3f s (%.0f frames/s)\n", headlessFrames, seconds,
+			seconds > 0 ? headlessFrames / seconds : 0.0);
+		printf("Captured %lu unique frames, dropped %lu\n", myCapture.framesEncoded, myCapture.framesDropped);
+		printf("State hash %08lX (seed %u)\n", stateHash(), seed);
+		if (expectGiven)
+		{
+			if (stateHash() != expectedHash)
+			{
+				fprintf(stderr, "State hash does not match expected %08lX\n", expectedHash);
+				return 4;
+			}
+			return 0;
+		}
+		if (myChip8.faults != 0)
+		{
+			fprintf(stderr, "ROM accessed memory out of bounds, fault flags 0x%X\n", myChip8.faults);
+			return 2;
+		}
+		return myCapture.framesDropped != 0 ? 3 : 0;
+	}
+
 	// Set up render system and register input callbacks
 	setupGraphics();
 
@@ -184,6 +309,12 @@ int main(int argc, char** argv) {
 			SDL_Delay(frameDelay - frameTime);
 		//printf("%d\n", frameTime);
 	}
+	myCapture.close();
+	if (myCapture.framesDropped != 0)
+		fprintf(stderr, "Capture dropped %lu of %lu unique frames\n", myCapture.framesDropped,
+			myCapture.framesDropped + myCapture.framesEncoded);
+	if (myChip8.faults != 0)
+		fprintf(stderr, "ROM accessed memory out of bounds, fault flags 0x%X\n", myChip8.faults);
 	SDL_DestroyWindow(myDisplay->window);
 	SDL_Quit();
 	return 0;